@@ -1,7 +1,9 @@
 #ifndef OREO_SRC_OREO_H_
 #define OREO_SRC_OREO_H_
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <map>
@@ -19,12 +21,253 @@ constexpr size_t kMaxStringLength = 1073741824;
 constexpr size_t kMaxVectorElementCount = 1073741824;
 constexpr size_t kMaxMapElementCount = 2048;
 
+// Wraps a trivially copyable value, or a vector of trivially copyable values,
+// so that it is encoded as its in-memory representation: one memcpy instead
+// of one varint per integer. The representation depends on the architecture
+// and the compiler, so only use it between processes built the same way.
+// All the bytes of T are copied, padding included: T should have no padding,
+// otherwise uninitialized memory is serialized, and DiffArchive, which
+// compares the bytes, can report changes when only the padding differs.
+// Usage: archive.Process(oreo::Raw(position_), oreo::Raw(particles_));
+template <typename T>
+class Raw {
+ public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "oreo::Raw requires a trivially copyable type");
+
+  explicit Raw(T& value) : value_(value) {}
+
+  T& value_;
+};
+
+// Vectors are encoded as their length, padding so that the first element is
+// aligned to alignof(T) relative to the start of the buffer, then the
+// elements.
+template <typename T>
+class Raw<std::vector<T>> {
+ public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "oreo::Raw requires a vector of trivially copyable types");
+
+  explicit Raw(std::vector<T>& value) : value_(value) {}
+
+  std::vector<T>& value_;
+};
+
+// Read-only view on elements encoded like a Raw vector. When deserialized, it
+// points into the deserialized buffer instead of copying the elements: the
+// buffer must outlive the view, and must be aligned like a buffer allocated
+// with new (deserialization fails otherwise).
+template <typename T>
+struct RawSpan {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "oreo::RawSpan requires a trivially copyable type");
+
+  const T* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Pool of reusable buffers for SerializationArchive.
+// Buffers are bucketed by size class (powers of two). Each thread keeps a few
+// buffers per size class in a thread-local cache; the rest go to a global
+// free list made of slots that are claimed with atomic compare-and-swap, so
+// leasing and releasing never block. Buffers are dropped when the pool (the
+// thread-local caches and the global free list together) would retain more
+// than |max_retained_bytes_|.
+class BufferPool {
+ public:
+  // Size classes go from 256 bytes to 16 MB.
+  static constexpr size_t kMinSizeClass = 8;
+  static constexpr size_t kMaxSizeClass = 24;
+  static constexpr size_t kSizeClassCount = kMaxSizeClass - kMinSizeClass + 1;
+  static constexpr size_t kThreadCacheSlotCount = 4;
+  static constexpr size_t kMaxThreadCacheBytes = 1 << 20;
+  static constexpr size_t kGlobalSlotCount = 32;
+  static constexpr size_t kDefaultMaxRetainedBytes = 64 << 20;
+
+  // Returns an empty buffer with a capacity of at least |capacity|.
+  static std::vector<uint8_t> Lease(size_t capacity) {
+    size_t size_class = SizeClassForLease(capacity);
+    std::vector<uint8_t> buffer;
+    if (size_class > kMaxSizeClass) {
+      buffer.reserve(capacity);
+      return buffer;
+    }
+    ThreadCache& cache = GetThreadCache();
+    size_t index = size_class - kMinSizeClass;
+    if (cache.count_[index] > 0) {
+      buffer = std::move(cache.buffers_[index][--cache.count_[index]]);
+      cache.bytes_ -= buffer.capacity();
+      GetGlobal().Unreserve(buffer.capacity());
+      return buffer;
+    }
+    if (GetGlobal().Pop(index, buffer)) {
+      GetGlobal().Unreserve(buffer.capacity());
+      return buffer;
+    }
+    buffer.reserve(size_t{1} << size_class);
+    return buffer;
+  }
+
+  // Gives |buffer| back to the pool. Can be called from any thread.
+  static void Release(std::vector<uint8_t> buffer) {
+    size_t size_class = SizeClassForRelease(buffer.capacity());
+    if (size_class < kMinSizeClass || size_class > kMaxSizeClass) {
+      return;
+    }
+    size_t bytes = buffer.capacity();
+    if (!GetGlobal().Reserve(bytes)) {
+      return;
+    }
+    buffer.clear();
+    ThreadCache& cache = GetThreadCache();
+    size_t index = size_class - kMinSizeClass;
+    if (cache.count_[index] < kThreadCacheSlotCount &&
+        cache.bytes_ + bytes <= kMaxThreadCacheBytes) {
+      cache.bytes_ += bytes;
+      cache.buffers_[index][cache.count_[index]++] = std::move(buffer);
+      return;
+    }
+    if (!GetGlobal().Push(index, std::move(buffer))) {
+      GetGlobal().Unreserve(bytes);
+    }
+  }
+
+  // Caps the memory retained by the pool, thread-local caches included.
+  static void SetMaxRetainedBytes(size_t max_retained_bytes) {
+    GetGlobal().max_retained_bytes_.store(max_retained_bytes,
+                                          std::memory_order_relaxed);
+  }
+
+  // Memory retained by the pool, thread-local caches included.
+  static size_t RetainedBytes() {
+    return GetGlobal().retained_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // Smallest size class that can hold |capacity| bytes.
+  static size_t SizeClassForLease(size_t capacity) {
+    size_t size_class = kMinSizeClass;
+    while (size_class <= kMaxSizeClass &&
+           (size_t{1} << size_class) < capacity) {
+      size_class++;
+    }
+    return size_class;
+  }
+
+  // Largest size class whose requests can be served by |capacity| bytes.
+  static size_t SizeClassForRelease(size_t capacity) {
+    size_t size_class = 0;
+    while (size_class <= kMaxSizeClass &&
+           (size_t{1} << (size_class + 1)) <= capacity) {
+      size_class++;
+    }
+    return size_class;
+  }
+
+  struct alignas(64) Slot {
+    static constexpr uint8_t kEmpty = 0;
+    static constexpr uint8_t kBusy = 1;
+    static constexpr uint8_t kFull = 2;
+    std::atomic<uint8_t> state_{kEmpty};
+    std::vector<uint8_t> buffer_;
+  };
+
+  struct Global {
+    bool Pop(size_t index, std::vector<uint8_t>& buffer) {
+      for (Slot& slot : slots_[index]) {
+        uint8_t expected = Slot::kFull;
+        if (slot.state_.load(std::memory_order_relaxed) == Slot::kFull &&
+            slot.state_.compare_exchange_strong(expected, Slot::kBusy,
+                                                std::memory_order_acquire)) {
+          buffer = std::move(slot.buffer_);
+          slot.state_.store(Slot::kEmpty, std::memory_order_release);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Accounts for |bytes| more retained memory. Returns false if the cap
+    // would be exceeded.
+    bool Reserve(size_t bytes) {
+      if (retained_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes >
+          max_retained_bytes_.load(std::memory_order_relaxed)) {
+        retained_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+
+    void Unreserve(size_t bytes) {
+      retained_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    // Returns false if all the slots are full.
+    bool Push(size_t index, std::vector<uint8_t>&& buffer) {
+      for (Slot& slot : slots_[index]) {
+        uint8_t expected = Slot::kEmpty;
+        if (slot.state_.load(std::memory_order_relaxed) == Slot::kEmpty &&
+            slot.state_.compare_exchange_strong(expected, Slot::kBusy,
+                                                std::memory_order_acquire)) {
+          slot.buffer_ = std::move(buffer);
+          slot.state_.store(Slot::kFull, std::memory_order_release);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    Slot slots_[kSizeClassCount][kGlobalSlotCount];
+    std::atomic<size_t> retained_bytes_{0};
+    std::atomic<size_t> max_retained_bytes_{kDefaultMaxRetainedBytes};
+  };
+
+  struct ThreadCache {
+    // Hands the cached buffers to the global free list when the thread exits.
+    ~ThreadCache() {
+      for (size_t index = 0; index < kSizeClassCount; index++) {
+        for (size_t i = 0; i < count_[index]; i++) {
+          size_t bytes = buffers_[index][i].capacity();
+          if (!GetGlobal().Push(index, std::move(buffers_[index][i]))) {
+            GetGlobal().Unreserve(bytes);
+          }
+        }
+      }
+    }
+
+    std::vector<uint8_t> buffers_[kSizeClassCount][kThreadCacheSlotCount];
+    size_t count_[kSizeClassCount] = {};
+    size_t bytes_ = 0;
+  };
+
+  static Global& GetGlobal() {
+    static Global global;
+    return global;
+  }
+
+  static ThreadCache& GetThreadCache() {
+    thread_local ThreadCache cache;
+    return cache;
+  }
+};
+
 class SerializationArchive {
  public:
   SerializationArchive() {}
 
   SerializationArchive(std::vector<uint8_t> const& buffer) : buffer_(buffer) {}
 
+  // Replaces |buffer_| by an empty buffer from BufferPool that can hold
+  // |capacity| bytes without reallocating.
+  void LeaseBuffer(size_t capacity) {
+    ReleaseBuffer();
+    buffer_ = BufferPool::Lease(capacity);
+  }
+
+  // Gives |buffer_| back to BufferPool. If the buffer was moved out of the
+  // archive (e.g. to be sent), give it back with BufferPool::Release once done.
+  void ReleaseBuffer() { BufferPool::Release(std::move(buffer_)); }
+
   template <class T>
   inline bool Process(T&& head) {
     ProcessImpl(head);
@@ -147,6 +390,40 @@ class SerializationArchive {
     }
   }
 
+  // For Raw
+  template <typename T>
+  void ProcessImpl(Raw<T> raw) {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(&raw.value_);
+    buffer_.insert(buffer_.end(), ptr, ptr + sizeof(T));
+  }
+
+  template <typename T>
+  void ProcessImpl(Raw<std::vector<T>> raw) {
+    ProcessRawArray(raw.value_.data(), raw.value_.size());
+  }
+
+  // For RawSpan
+  template <typename T>
+  void ProcessImpl(RawSpan<T> const& span) {
+    ProcessRawArray(span.data_, span.size_);
+  }
+
+  template <typename T>
+  void ProcessRawArray(const T* ptr, size_t N) {
+    // The padding is encoded on one byte.
+    static_assert(alignof(T) <= 256);
+    uint32_t length = static_cast<uint32_t>(N);
+    ProcessImpl(length);
+    if constexpr (alignof(T) > 1) {
+      uint8_t padding = static_cast<uint8_t>(
+          (alignof(T) - (buffer_.size() + 1) % alignof(T)) % alignof(T));
+      buffer_.push_back(padding);
+      buffer_.insert(buffer_.end(), padding, 0);
+    }
+    const uint8_t* casted_ptr = reinterpret_cast<const uint8_t*>(ptr);
+    buffer_.insert(buffer_.end(), casted_ptr, casted_ptr + N * sizeof(T));
+  }
+
   // For everything else
   template <typename T>
   typename std::enable_if<!(std::is_integral<T>::value ||
@@ -395,6 +672,78 @@ class DeserializationArchive {
     return true;
   }
 
+  // For Raw
+  template <typename T>
+  [[nodiscard]] bool ProcessImpl(Raw<T> raw) {
+    if (static_cast<size_t>(end_cursor_ - current_cursor_) < sizeof(T)) {
+      return false;
+    }
+    memcpy(&raw.value_, current_cursor_, sizeof(T));
+    current_cursor_ += sizeof(T);
+    return true;
+  }
+
+  template <typename T>
+  [[nodiscard]] bool ProcessImpl(Raw<std::vector<T>> raw) {
+    uint32_t length;
+    const uint8_t* ptr;
+    if (!ProcessRawArray<T>(length, ptr)) {
+      return false;
+    }
+    raw.value_.resize(length);
+    if (length > 0) {
+      memcpy(raw.value_.data(), ptr, length * sizeof(T));
+    }
+    return true;
+  }
+
+  // For RawSpan
+  template <typename T>
+  [[nodiscard]] bool ProcessImpl(RawSpan<T>& span) {
+    uint32_t length;
+    const uint8_t* ptr;
+    if (!ProcessRawArray<T>(length, ptr)) {
+      return false;
+    }
+    if (reinterpret_cast<uintptr_t>(ptr) % alignof(T) != 0) {
+      return false;
+    }
+    span.data_ = reinterpret_cast<const T*>(ptr);
+    span.size_ = length;
+    return true;
+  }
+
+  // Reads the length of a Raw vector, skips the padding, and sets |ptr| to the
+  // first element.
+  template <typename T>
+  [[nodiscard]] bool ProcessRawArray(uint32_t& length, const uint8_t*& ptr) {
+    static_assert(alignof(T) <= 256);
+    if (!ProcessImpl(length)) {
+      return false;
+    }
+    if (length > kMaxVectorElementCount) {
+      return false;
+    }
+    size_t padding = 0;
+    if constexpr (alignof(T) > 1) {
+      uint8_t padding_byte;
+      if (!ProcessImpl(padding_byte)) {
+        return false;
+      }
+      if (padding_byte >= alignof(T)) {
+        return false;
+      }
+      padding = padding_byte;
+    }
+    size_t byte_count = padding + size_t{length} * sizeof(T);
+    if (static_cast<size_t>(end_cursor_ - current_cursor_) < byte_count) {
+      return false;
+    }
+    ptr = current_cursor_ + padding;
+    current_cursor_ += byte_count;
+    return true;
+  }
+
   // For everything else
   template <typename T>
   [[nodiscard]] typename std::enable_if<!(std::is_integral<T>::value ||
@@ -408,6 +757,624 @@ class DeserializationArchive {
   const uint8_t* end_cursor_;
 };
 
+// The address of |kFieldTag<T>| identifies the type T without RTTI.
+template <typename T>
+inline constexpr char kFieldTag = 0;
+
+// Records the address and the type of every field processed by a RunArchive
+// function, in order. Used by DiffArchive to pair the fields of two instances
+// of a type.
+class FieldCollectorArchive {
+ public:
+  struct Field {
+    const void* address_;
+    const void* tag_;
+  };
+
+  explicit FieldCollectorArchive(std::vector<Field>& fields)
+      : fields_(fields) {}
+
+  template <class... T>
+  inline bool Process(T&&... fields) {
+    (fields_.push_back(MakeField(fields)), ...);
+    return true;
+  }
+
+  template <typename T>
+  static Field MakeField(T const& field) {
+    return {&field, &kFieldTag<T>};
+  }
+
+  // Raw wrappers are temporaries: record the wrapped field instead.
+  template <typename T>
+  static Field MakeField(Raw<T> raw) {
+    return {&raw.value_, &kFieldTag<Raw<T>>};
+  }
+
+  std::vector<Field>& fields_;
+};
+
+// Computes a patch that transforms |old_value| into |new_value|.
+// Only the fields that changed are encoded: structs encode the position of
+// each changed field followed by its patch, vectors and arrays encode the
+// changed elements, maps encode the removed keys and the inserted or changed
+// entries. Leaves (integers, enums, booleans, floats, strings, vectors of
+// bytes) are encoded like SerializationArchive does.
+// RunArchive must process the same fields in the same order for both
+// instances.
+class DiffArchive {
+ public:
+  // Replaces the content of |buffer_| by the patch. Returns false if the
+  // values are identical, or if RunArchive did not process fields of the same
+  // types for both values. |buffer_| is then empty.
+  template <typename T>
+  bool Diff(T const& old_value, T const& new_value) {
+    buffer_.clear();
+    fields_mismatch_ = false;
+    if (!DiffImpl(old_value, new_value) || fields_mismatch_) {
+      buffer_.clear();
+      return false;
+    }
+    return true;
+  }
+
+  template <class T>
+  inline bool Process(T&& head) {
+    ProcessField(head);
+    return true;
+  }
+
+  // Unwinds to process all data
+  template <class T, class... Other>
+  inline bool Process(T&& head, Other&&... tail) {
+    ProcessField(head);
+    return Process(std::forward<Other>(tail)...);
+  }
+
+  // Pairs |new_value| with the field at the same position in the old
+  // instance.
+  template <typename T>
+  void ProcessField(T const& new_value) {
+    const void* old_field = NextOldField(&kFieldTag<T>);
+    if (old_field == nullptr) {
+      return;
+    }
+    DiffField(*static_cast<const T*>(old_field), new_value);
+  }
+
+  template <typename T>
+  void ProcessField(Raw<T> new_value) {
+    const void* old_field = NextOldField(&kFieldTag<Raw<T>>);
+    if (old_field == nullptr) {
+      return;
+    }
+    Raw<T> old_value(*const_cast<T*>(static_cast<const T*>(old_field)));
+    DiffField(old_value, new_value);
+  }
+
+  // Returns nullptr if the old instance has fewer fields, or if the type of its
+  // field differs.
+  const void* NextOldField(const void* tag) {
+    std::vector<FieldCollectorArchive::Field> const& old_fields =
+        old_fields_[frame_->depth_];
+    if (frame_->index_ >= old_fields.size() ||
+        old_fields[frame_->index_].tag_ != tag) {
+      fields_mismatch_ = true;
+      return nullptr;
+    }
+    return old_fields[frame_->index_++].address_;
+  }
+
+  template <typename T>
+  void DiffField(T const& old_value, T const& new_value) {
+    size_t mark = buffer_.size();
+    Write(frame_->gap_ + 1);
+    if (DiffImpl(old_value, new_value)) {
+      frame_->gap_ = 0;
+      frame_->changed_ = true;
+    } else {
+      buffer_.resize(mark);
+      frame_->gap_++;
+    }
+  }
+
+  // All the DiffImpl functions return true if the values differ. When the
+  // values are identical, the content appended to |buffer_| is discarded by
+  // the caller.
+
+  // For integral types, enums and booleans
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value ||
+                              std::is_enum<T>::value,
+                          bool>::type
+  DiffImpl(T old_value, T new_value) {
+    if (old_value == new_value) {
+      return false;
+    }
+    Write(new_value);
+    return true;
+  }
+
+  // For floats. Compares the representations so that -0.0f and NaNs are
+  // handled.
+  bool DiffImpl(float old_value, float new_value) {
+    if (memcmp(&old_value, &new_value, sizeof(float)) == 0) {
+      return false;
+    }
+    Write(new_value);
+    return true;
+  }
+
+  // For strings
+  bool DiffImpl(std::string const& old_value, std::string const& new_value) {
+    if (old_value == new_value) {
+      return false;
+    }
+    Write(new_value);
+    return true;
+  }
+
+  // For unique_ptr
+  template <typename T>
+  bool DiffImpl(std::unique_ptr<T> const& old_value,
+                std::unique_ptr<T> const& new_value) {
+    if (old_value == nullptr && new_value == nullptr) {
+      return false;
+    }
+    if (old_value != nullptr && new_value != nullptr) {
+      Write(kPatchValue);
+      return DiffImpl(*old_value, *new_value);
+    }
+    Write(kReplaceValue);
+    Write(new_value);
+    return true;
+  }
+
+  // For std::optional
+  template <typename T>
+  bool DiffImpl(std::optional<T> const& old_value,
+                std::optional<T> const& new_value) {
+    if (!old_value.has_value() && !new_value.has_value()) {
+      return false;
+    }
+    if (old_value.has_value() && new_value.has_value()) {
+      Write(kPatchValue);
+      return DiffImpl(old_value.value(), new_value.value());
+    }
+    Write(kReplaceValue);
+    Write(new_value);
+    return true;
+  }
+
+  // For Raw. Compares the representations.
+  template <typename T>
+  bool DiffImpl(Raw<T> old_value, Raw<T> new_value) {
+    if (memcmp(&old_value.value_, &new_value.value_, sizeof(T)) == 0) {
+      return false;
+    }
+    Write(new_value);
+    return true;
+  }
+
+  template <typename T>
+  bool DiffImpl(Raw<std::vector<T>> old_value, Raw<std::vector<T>> new_value) {
+    if (old_value.value_.size() == new_value.value_.size() &&
+        (new_value.value_.empty() ||
+         memcmp(old_value.value_.data(), new_value.value_.data(),
+                new_value.value_.size() * sizeof(T)) == 0)) {
+      return false;
+    }
+    Write(new_value);
+    return true;
+  }
+
+  // For vectors
+  template <typename T>
+  bool DiffImpl(std::vector<T> const& old_value,
+                std::vector<T> const& new_value) {
+    if constexpr (sizeof(T) == 1) {
+      // Vectors of uint8_t and int8_t are patched as a whole. Like
+      // SerializationArchive, T does not need operator==.
+      if (old_value.size() == new_value.size() &&
+          (new_value.empty() ||
+           memcmp(old_value.data(), new_value.data(), new_value.size()) ==
+               0)) {
+        return false;
+      }
+      Write(new_value);
+      return true;
+    } else {
+      uint32_t length = static_cast<uint32_t>(new_value.size());
+      Write(length);
+      size_t common_length = std::min(old_value.size(), new_value.size());
+      bool changed = DiffElements(old_value.data(), new_value.data(),
+                                  common_length);
+      for (size_t i = common_length; i < new_value.size(); i++) {
+        Write(new_value[i]);
+      }
+      return changed || old_value.size() != new_value.size();
+    }
+  }
+
+  // For std::arrays
+  template <typename T, std::size_t N>
+  bool DiffImpl(std::array<T, N> const& old_value,
+                std::array<T, N> const& new_value) {
+    if constexpr (sizeof(T) == 1) {
+      if (N == 0 || memcmp(old_value.data(), new_value.data(), N) == 0) {
+        return false;
+      }
+      Write(new_value);
+      return true;
+    } else {
+      return DiffElements(old_value.data(), new_value.data(), N);
+    }
+  }
+
+  // Encodes the changed elements as a sequence of (gap + 1, element patch),
+  // where gap is the number of unchanged elements since the previous changed
+  // element. The sequence is terminated by 0.
+  template <typename T>
+  bool DiffElements(const T* old_elements,
+                    const T* new_elements,
+                    size_t count) {
+    bool changed = false;
+    uint64_t gap = 0;
+    for (size_t i = 0; i < count; i++) {
+      size_t mark = buffer_.size();
+      Write(gap + 1);
+      if (DiffImpl(old_elements[i], new_elements[i])) {
+        gap = 0;
+        changed = true;
+      } else {
+        buffer_.resize(mark);
+        gap++;
+      }
+    }
+    Write(uint64_t{0});
+    return changed;
+  }
+
+  // For std::map
+  template <typename K, typename V>
+  bool DiffImpl(std::map<K, V> const& old_value,
+                std::map<K, V> const& new_value) {
+    uint32_t removed_count = 0;
+    for (auto const& it : old_value) {
+      if (new_value.find(it.first) == new_value.end()) {
+        removed_count++;
+      }
+    }
+    Write(removed_count);
+    for (auto const& it : old_value) {
+      if (new_value.find(it.first) == new_value.end()) {
+        Write(it.first);
+      }
+    }
+    bool changed = removed_count != 0;
+    for (auto const& it : new_value) {
+      auto old_it = old_value.find(it.first);
+      if (old_it == old_value.end()) {
+        Write(kReplaceValue);
+        Write(it.first);
+        Write(it.second);
+        changed = true;
+        continue;
+      }
+      size_t mark = buffer_.size();
+      Write(kPatchValue);
+      Write(it.first);
+      if (DiffImpl(old_it->second, it.second)) {
+        changed = true;
+      } else {
+        buffer_.resize(mark);
+      }
+    }
+    Write(kEndOfEntries);
+    return changed;
+  }
+
+  // For everything else. Encodes the changed fields as a sequence of
+  // (gap + 1, field patch), terminated by 0.
+  template <typename T>
+  typename std::enable_if<!(std::is_integral<T>::value ||
+                            std::is_enum<T>::value),
+                          bool>::type
+  DiffImpl(T const& old_value, T const& new_value) {
+    Frame frame;
+    frame.depth_ = frame_ == nullptr ? 0 : frame_->depth_ + 1;
+    // The vectors of field addresses are reused across diffs.
+    if (frame.depth_ == old_fields_.size()) {
+      old_fields_.emplace_back();
+    }
+    old_fields_[frame.depth_].clear();
+    FieldCollectorArchive collector(old_fields_[frame.depth_]);
+    const_cast<T&>(old_value).RunArchive(collector);
+    Frame* parent_frame = frame_;
+    frame_ = &frame;
+    const_cast<T&>(new_value).RunArchive(*this);
+    frame_ = parent_frame;
+    if (frame.index_ != old_fields_[frame.depth_].size()) {
+      fields_mismatch_ = true;
+    }
+    Write(uint64_t{0});
+    return frame.changed_;
+  }
+
+  // Appends the serialization of |value| to |buffer_|.
+  template <typename T>
+  void Write(T const& value) {
+    writer_.buffer_.swap(buffer_);
+    writer_.Process(const_cast<T&>(value));
+    writer_.buffer_.swap(buffer_);
+  }
+
+  static constexpr uint8_t kEndOfEntries = 0;
+  static constexpr uint8_t kReplaceValue = 1;
+  static constexpr uint8_t kPatchValue = 2;
+
+  struct Frame {
+    // Index in |old_fields_|.
+    size_t depth_ = 0;
+    size_t index_ = 0;
+    uint64_t gap_ = 0;
+    bool changed_ = false;
+  };
+
+  std::vector<uint8_t> buffer_;
+  SerializationArchive writer_;
+  Frame* frame_ = nullptr;
+  // Fields of the old instances, one vector per nesting depth.
+  std::vector<std::vector<FieldCollectorArchive::Field>> old_fields_;
+  bool fields_mismatch_ = false;
+};
+
+// Applies a patch produced by DiffArchive to an object equal to the old value
+// that was passed to DiffArchive::Diff.
+class PatchArchive {
+ public:
+  // |end| is the theoretical element that would follow the last element in the
+  // vector.
+  PatchArchive(const uint8_t* data, const uint8_t* end) : reader_(data, end) {}
+
+  PatchArchive(std::vector<uint8_t> const& buffer) : reader_(buffer) {}
+
+  // Fields of the struct being patched that precede the next patched field.
+  struct Frame {
+    uint64_t skip_ = 0;
+    bool done_ = false;
+  };
+
+  // An empty patch leaves |value| untouched.
+  template <typename T>
+  [[nodiscard]] bool Apply(T& value) {
+    if (reader_.current_cursor_ >= reader_.end_cursor_) {
+      return true;
+    }
+    return ApplyImpl(value);
+  }
+
+  template <class T>
+  [[nodiscard]] inline bool Process(T&& head) {
+    return ProcessField(head);
+  }
+
+  // Unwinds to process all data
+  template <class T, class... Other>
+  [[nodiscard]] inline bool Process(T&& head, Other&&... tail) {
+    bool success = ProcessField(head);
+    if (!success) {
+      return false;
+    }
+    return Process(std::forward<Other>(tail)...);
+  }
+
+  template <typename T>
+  [[nodiscard]] bool ProcessField(T& field) {
+    if (frame_->done_) {
+      return true;
+    }
+    if (frame_->skip_ > 0) {
+      frame_->skip_--;
+      return true;
+    }
+    if (!ApplyImpl(field)) {
+      return false;
+    }
+    return ReadGap(*frame_);
+  }
+
+  [[nodiscard]] bool ReadGap(Frame& frame) {
+    uint64_t gap;
+    if (!reader_.Process(gap)) {
+      return false;
+    }
+    if (gap == 0) {
+      frame.done_ = true;
+    } else {
+      frame.skip_ = gap - 1;
+    }
+    return true;
+  }
+
+  // For integral types, enums, booleans, floats and strings
+  template <typename T>
+  [[nodiscard]] typename std::enable_if<std::is_integral<T>::value ||
+                                            std::is_enum<T>::value ||
+                                            std::is_same<T, float>::value ||
+                                            std::is_same<T, std::string>::value,
+                                        bool>::type
+  ApplyImpl(T& value) {
+    return reader_.Process(value);
+  }
+
+  // For Raw
+  template <typename T>
+  [[nodiscard]] bool ApplyImpl(Raw<T> raw) {
+    return reader_.Process(raw);
+  }
+
+  // For unique_ptr
+  template <typename T>
+  [[nodiscard]] bool ApplyImpl(std::unique_ptr<T>& ptr) {
+    uint8_t kind;
+    if (!reader_.Process(kind)) {
+      return false;
+    }
+    if (kind == DiffArchive::kReplaceValue) {
+      return reader_.Process(ptr);
+    }
+    if (kind != DiffArchive::kPatchValue || ptr == nullptr) {
+      return false;
+    }
+    return ApplyImpl(*ptr);
+  }
+
+  // For std::optional
+  template <typename T>
+  [[nodiscard]] bool ApplyImpl(std::optional<T>& o) {
+    uint8_t kind;
+    if (!reader_.Process(kind)) {
+      return false;
+    }
+    if (kind == DiffArchive::kReplaceValue) {
+      return reader_.Process(o);
+    }
+    if (kind != DiffArchive::kPatchValue || !o.has_value()) {
+      return false;
+    }
+    return ApplyImpl(o.value());
+  }
+
+  // For vectors
+  template <typename T>
+  [[nodiscard]] bool ApplyImpl(std::vector<T>& v) {
+    if constexpr (sizeof(T) == 1) {
+      return reader_.Process(v);
+    } else {
+      uint32_t length;
+      if (!reader_.Process(length)) {
+        return false;
+      }
+      if (length > kMaxVectorElementCount) {
+        return false;
+      }
+      size_t old_length = v.size();
+      if (!ApplyElements(v.data(), std::min<size_t>(old_length, length))) {
+        return false;
+      }
+      v.resize(length);
+      for (size_t i = old_length; i < length; i++) {
+        if (!reader_.Process(v[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+  }
+
+  // For arrays
+  template <typename T, std::size_t N>
+  [[nodiscard]] bool ApplyImpl(std::array<T, N>& v) {
+    if constexpr (sizeof(T) == 1) {
+      return reader_.Process(v);
+    } else {
+      return ApplyElements(v.data(), N);
+    }
+  }
+
+  template <typename T>
+  [[nodiscard]] bool ApplyElements(T* elements, size_t count) {
+    size_t index = 0;
+    while (true) {
+      uint64_t gap;
+      if (!reader_.Process(gap)) {
+        return false;
+      }
+      if (gap == 0) {
+        return true;
+      }
+      // Check for corrupted stream.
+      if (gap - 1 >= count - index) {
+        return false;
+      }
+      index += gap - 1;
+      if (!ApplyImpl(elements[index])) {
+        return false;
+      }
+      index++;
+    }
+  }
+
+  // For std::map
+  template <typename K, typename V>
+  [[nodiscard]] bool ApplyImpl(std::map<K, V>& m) {
+    uint32_t removed_count;
+    if (!reader_.Process(removed_count)) {
+      return false;
+    }
+    if (removed_count > kMaxMapElementCount) {
+      return false;
+    }
+    K key;
+    for (uint32_t i = 0; i < removed_count; i++) {
+      if (!reader_.Process(key)) {
+        return false;
+      }
+      m.erase(key);
+    }
+    while (true) {
+      uint8_t kind;
+      if (!reader_.Process(kind)) {
+        return false;
+      }
+      if (kind == DiffArchive::kEndOfEntries) {
+        return true;
+      }
+      if (!reader_.Process(key)) {
+        return false;
+      }
+      if (kind == DiffArchive::kReplaceValue) {
+        V value;
+        if (!reader_.Process(value)) {
+          return false;
+        }
+        m[key] = std::move(value);
+        continue;
+      }
+      auto it = m.find(key);
+      if (kind != DiffArchive::kPatchValue || it == m.end()) {
+        return false;
+      }
+      if (!ApplyImpl(it->second)) {
+        return false;
+      }
+    }
+  }
+
+  // For everything else
+  template <typename T>
+  [[nodiscard]] typename std::enable_if<
+      !(std::is_integral<T>::value || std::is_enum<T>::value ||
+        std::is_same<T, float>::value || std::is_same<T, std::string>::value),
+      bool>::type
+  ApplyImpl(T& value) {
+    Frame frame;
+    if (!ReadGap(frame)) {
+      return false;
+    }
+    Frame* parent_frame = frame_;
+    frame_ = &frame;
+    bool success = value.RunArchive(*this);
+    frame_ = parent_frame;
+    // All the patched fields must have been consumed.
+    return success && frame.done_;
+  }
+
+  DeserializationArchive reader_;
+  Frame* frame_ = nullptr;
+};
+
 }  // namespace oreo
 
 #endif  // OREO_SRC_OREO_H_
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdio>
@@ -5,6 +6,7 @@
 #include <map>
 #include <optional>
 #include <string>
+#include <thread>
 
 #include "oreo.h"
 
@@ -38,6 +40,105 @@ struct Foo {
   }
 };
 
+struct State {
+  uint32_t tick_ = 0;
+  std::string name_;
+  std::vector<Bar> bars_;
+  std::array<int32_t, 3> position_ = {};
+  std::map<std::string, Bar> named_bars_;
+  std::optional<Bar> selected_;
+  std::unique_ptr<Bar> owned_;
+  std::vector<uint8_t> payload_;
+  float speed_ = 0;
+  template <class Archive>
+  bool RunArchive(Archive& archive) {
+    return archive.Process(tick_, name_, bars_, position_, named_bars_,
+                           selected_, owned_, payload_, speed_);
+  }
+};
+
+struct Versioned {
+  uint8_t version_ = 0;
+  uint32_t extra_ = 0;
+  template <class Archive>
+  bool RunArchive(Archive& archive) {
+    if (version_ == 0) {
+      return archive.Process(version_);
+    }
+    return archive.Process(version_, extra_);
+  }
+};
+
+// Processes the same number of fields for both kinds, with different types.
+struct Variant {
+  uint8_t kind_ = 0;
+  uint32_t number_ = 0;
+  std::string text_;
+  template <class Archive>
+  bool RunArchive(Archive& archive) {
+    return kind_ == 0 ? archive.Process(kind_, number_)
+                      : archive.Process(kind_, text_);
+  }
+};
+
+// A 1-byte struct without operator==.
+struct Flag {
+  uint8_t v_ = 0;
+  template <class Archive>
+  bool RunArchive(Archive& archive) {
+    return archive.Process(v_);
+  }
+};
+
+struct Flags {
+  std::vector<Flag> flags_;
+  std::array<Flag, 2> pair_;
+  template <class Archive>
+  bool RunArchive(Archive& archive) {
+    return archive.Process(flags_, pair_);
+  }
+};
+
+struct Vec3 {
+  float x_;
+  float y_;
+  float z_;
+  bool operator==(Vec3 const& other) const {
+    return x_ == other.x_ && y_ == other.y_ && z_ == other.z_;
+  }
+};
+
+// No padding, as required by oreo::Raw.
+struct Particle {
+  Vec3 position_;
+  uint32_t id_;
+  uint8_t flags_;
+  uint8_t reserved_[3];
+};
+static_assert(sizeof(Particle) == sizeof(Vec3) + sizeof(uint32_t) + 4);
+
+struct Scene {
+  std::string name_;
+  Vec3 origin_;
+  std::vector<Vec3> points_;
+  std::vector<Particle> particles_;
+  template <class Archive>
+  bool RunArchive(Archive& archive) {
+    return archive.Process(name_, oreo::Raw(origin_), oreo::Raw(points_),
+                           oreo::Raw(particles_));
+  }
+};
+
+struct SceneView {
+  std::string name_;
+  Vec3 origin_;
+  oreo::RawSpan<Vec3> points_;
+  template <class Archive>
+  bool RunArchive(Archive& archive) {
+    return archive.Process(name_, oreo::Raw(origin_), points_);
+  }
+};
+
 template <class T>
 void CheckCorrectness(std::vector<T> v) {
   {
@@ -122,6 +223,31 @@ void CheckVarLengthInteger(int64_t v, std::vector<uint8_t> expected) {
   assert(v == v2);
 }
 
+template <class T>
+std::vector<uint8_t> Serialize(T const& object) {
+  oreo::SerializationArchive sa;
+  sa.Process(object);
+  return sa.buffer_;
+}
+
+// Checks that patching a copy of |old_value| produces |new_value|.
+template <class T>
+std::vector<uint8_t> CheckDiffAndPatch(T const& old_value, T const& new_value) {
+  oreo::DiffArchive diff;
+  bool changed = diff.Diff(old_value, new_value);
+  assert(changed == (Serialize(old_value) != Serialize(new_value)));
+  assert(changed == !diff.buffer_.empty());
+
+  std::vector<uint8_t> old_buffer = Serialize(old_value);
+  oreo::DeserializationArchive da(old_buffer);
+  T patched;
+  assert(da.Process(patched));
+  oreo::PatchArchive pa(diff.buffer_);
+  assert(pa.Apply(patched));
+  assert(Serialize(patched) == Serialize(new_value));
+  return diff.buffer_;
+}
+
 int main() {
   Bar b0{"xyz", 19};
   Bar b1{"foo", 86};
@@ -342,6 +468,289 @@ int main() {
     CheckCorrectness(o2);
   }
 
+  {
+    // Test diff and patch
+    State s0;
+    s0.tick_ = 1000;
+    s0.name_ = "state";
+    s0.bars_ = {b0, b1, b0};
+    s0.position_ = {10, -20, 30};
+    s0.named_bars_["a"] = b0;
+    s0.named_bars_["b"] = b1;
+    s0.selected_ = b1;
+    s0.payload_ = {1, 2, 3};
+    s0.speed_ = 2.5f;
+
+    State s1;
+    CheckDiffAndPatch(s0, s1);
+    CheckDiffAndPatch(s1, s0);
+    assert(CheckDiffAndPatch(s0, s0).empty());
+
+    auto copy = [](State const& s) {
+      std::vector<uint8_t> buffer = Serialize(s);
+      oreo::DeserializationArchive da(buffer);
+      State result;
+      assert(da.Process(result));
+      return result;
+    };
+
+    // Single field change: position of the field, then its value.
+    s1 = copy(s0);
+    s1.tick_ = 1001;
+    std::vector<uint8_t> expected_patch = {1, 0xe9, 0x07, 0};
+    assert(CheckDiffAndPatch(s0, s1) == expected_patch);
+    s1 = copy(s0);
+    s1.speed_ = -0.0f;
+    CheckDiffAndPatch(s0, s1);
+
+    // Vector elements.
+    s1 = copy(s0);
+    s1.bars_[1].b_ = 87;
+    expected_patch = {3, 3, 2, 2, 87, 0, 0, 0};
+    assert(CheckDiffAndPatch(s0, s1) == expected_patch);
+    s1.bars_.push_back(b1);
+    CheckDiffAndPatch(s0, s1);
+    CheckDiffAndPatch(s1, s0);
+    s1.bars_.clear();
+    CheckDiffAndPatch(s0, s1);
+    CheckDiffAndPatch(s1, s0);
+
+    // Array elements.
+    s1 = copy(s0);
+    s1.position_[2] = 31;
+    CheckDiffAndPatch(s0, s1);
+
+    // Map entries.
+    s1 = copy(s0);
+    s1.named_bars_.erase("a");
+    s1.named_bars_["b"].a_ = "bar";
+    s1.named_bars_["c"] = b0;
+    CheckDiffAndPatch(s0, s1);
+    CheckDiffAndPatch(s1, s0);
+
+    // std::optional and std::unique_ptr.
+    s1 = copy(s0);
+    s1.selected_->b_ = 0;
+    s1.owned_ = std::make_unique<Bar>(b0);
+    CheckDiffAndPatch(s0, s1);
+    CheckDiffAndPatch(s1, s0);
+    s1.selected_.reset();
+    CheckDiffAndPatch(s0, s1);
+    CheckDiffAndPatch(s1, s0);
+
+    // Vectors of bytes.
+    s1 = copy(s0);
+    s1.payload_.push_back(4);
+    CheckDiffAndPatch(s0, s1);
+
+    // Leaves and containers at the top level.
+    CheckDiffAndPatch(std::string("foo"), std::string("bar"));
+    CheckDiffAndPatch(s0.bars_, s1.bars_);
+    CheckDiffAndPatch(int32s, std::vector<int32_t>{0, 1, 3});
+
+    // Instances whose RunArchive process different fields are rejected.
+    {
+      Versioned v0;
+      Versioned v1{1, 2};
+      oreo::DiffArchive diff;
+      assert(diff.Diff(v0, v1) == false);
+      assert(diff.buffer_.empty());
+      assert(diff.Diff(v1, v0) == false);
+      assert(diff.buffer_.empty());
+      v0.version_ = 1;
+      assert(diff.Diff(v0, v1));
+
+      Variant n{0, 42, ""};
+      Variant t{1, 0, "forty-two"};
+      assert(diff.Diff(n, t) == false);
+      assert(diff.buffer_.empty());
+      assert(diff.Diff(t, n) == false);
+      assert(diff.buffer_.empty());
+    }
+
+    // Vectors and arrays of 1-byte structs are compared bytewise.
+    {
+      Flags f0;
+      Flags f1;
+      f1.flags_.push_back(Flag{3});
+      CheckDiffAndPatch(f0, f1);
+      f0 = f1;
+      f1.pair_[1].v_ = 7;
+      CheckDiffAndPatch(f0, f1);
+      CheckDiffAndPatch(f1, f1);
+    }
+
+    // Truncated patches are rejected.
+    s1 = copy(s0);
+    s1.bars_[2].a_ = "abc";
+    s1.named_bars_["b"].b_ = 0;
+    oreo::DiffArchive diff;
+    assert(diff.Diff(s0, s1));
+    for (size_t i = 1; i < diff.buffer_.size(); i++) {
+      State patched = copy(s0);
+      oreo::PatchArchive pa(diff.buffer_.data(), diff.buffer_.data() + i);
+      assert(pa.Apply(patched) == false);
+    }
+  }
+
+  {
+    // Test BufferPool
+    assert(oreo::BufferPool::SizeClassForLease(0) == 8);
+    assert(oreo::BufferPool::SizeClassForLease(256) == 8);
+    assert(oreo::BufferPool::SizeClassForLease(257) == 9);
+    assert(oreo::BufferPool::SizeClassForRelease(255) == 7);
+    assert(oreo::BufferPool::SizeClassForRelease(256) == 8);
+    assert(oreo::BufferPool::SizeClassForRelease(511) == 8);
+
+    oreo::SerializationArchive sa;
+    sa.LeaseBuffer(1000);
+    assert(sa.buffer_.empty());
+    assert(sa.buffer_.capacity() >= 1000);
+    const uint8_t* data = sa.buffer_.data();
+    sa.Process(foo0);
+    assert(sa.buffer_ == expected_output);
+    std::vector<uint8_t> sent = std::move(sa.buffer_);
+    oreo::BufferPool::Release(std::move(sent));
+    // The buffer is reused by the next lease of the same size class.
+    sa.LeaseBuffer(600);
+    assert(sa.buffer_.data() == data);
+    assert(sa.buffer_.empty());
+    sa.ReleaseBuffer();
+    assert(sa.buffer_.capacity() == 0);
+
+    // Buffers are leased on some threads and released on others.
+    std::vector<std::vector<uint8_t>> in_flight[4];
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&, t]() {
+        for (int i = 0; i < 200; i++) {
+          oreo::SerializationArchive thread_sa;
+          thread_sa.LeaseBuffer(static_cast<size_t>(1) << (8 + i % 6));
+          thread_sa.Process(foo0);
+          assert(thread_sa.buffer_ == expected_output);
+          in_flight[t].push_back(std::move(thread_sa.buffer_));
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&, t]() {
+        for (auto& buffer : in_flight[(t + 1) % 4]) {
+          oreo::BufferPool::Release(std::move(buffer));
+          oreo::SerializationArchive thread_sa;
+          thread_sa.LeaseBuffer(300);
+          thread_sa.Process(foo0);
+          assert(thread_sa.buffer_ == expected_output);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    assert(oreo::BufferPool::RetainedBytes() > 0);
+
+    // Empty this thread's cache of 4 KB buffers.
+    for (size_t i = 0; i < oreo::BufferPool::kThreadCacheSlotCount; i++) {
+      oreo::BufferPool::Lease(4096);
+    }
+    // Buffers kept in the thread-local cache count as retained memory.
+    size_t retained_bytes = oreo::BufferPool::RetainedBytes();
+    oreo::BufferPool::Release(std::vector<uint8_t>(4096));
+    assert(oreo::BufferPool::RetainedBytes() == retained_bytes + 4096);
+    oreo::BufferPool::Lease(4096);
+    assert(oreo::BufferPool::RetainedBytes() == retained_bytes);
+
+    // The retained memory is capped, even when the thread-local cache has
+    // room.
+    oreo::BufferPool::SetMaxRetainedBytes(retained_bytes);
+    for (int i = 0; i < 20; i++) {
+      oreo::BufferPool::Release(std::vector<uint8_t>(4096));
+    }
+    assert(oreo::BufferPool::RetainedBytes() == retained_bytes);
+    oreo::BufferPool::SetMaxRetainedBytes(
+        oreo::BufferPool::kDefaultMaxRetainedBytes);
+  }
+
+  {
+    // Test Raw
+    Scene scene;
+    scene.name_ = "sc";
+    scene.origin_ = {1.5f, 0, 0};
+    scene.points_ = {{1, 2, 3}, {4, 5, 6}};
+    scene.particles_ = {
+        {{1, 1, 1}, 7, 1}, {{2, 2, 2}, 8, 0}, {{3, 3, 3}, 9, 1}};
+    oreo::SerializationArchive sa;
+    sa.Process(scene);
+    std::vector<uint8_t> expected_prefix = {
+        2, 's', 'c', 0, 0, 0xc0, 0x3f, 0, 0, 0, 0, 0, 0, 0, 0,
+        // |points_|: length, padding relative to the start of the buffer.
+        2, 3, 0, 0, 0,
+        // points_[0].x_ starts at offset 20.
+        0, 0, 0x80, 0x3f};
+    assert(std::equal(expected_prefix.begin(), expected_prefix.end(),
+                      sa.buffer_.begin()));
+    // |particles_| starts at offset 44, its first element at offset 48.
+    assert(sa.buffer_[44] == 3);
+    assert(sa.buffer_[45] == 2);
+    assert(sa.buffer_.size() == 48 + 3 * sizeof(Particle));
+
+    oreo::DeserializationArchive da(sa.buffer_);
+    Scene scene2;
+    scene2.points_ = {{0, 0, 0}};
+    assert(da.Process(scene2));
+    assert(da.current_cursor_ == da.end_cursor_);
+    assert(scene2.name_ == scene.name_);
+    assert(scene2.origin_ == scene.origin_);
+    assert(scene2.points_ == scene.points_);
+    assert(scene2.particles_.size() == 3);
+    assert(scene2.particles_[2].position_ == scene.particles_[2].position_);
+    assert(scene2.particles_[2].id_ == 9);
+    assert(scene2.particles_[2].flags_ == 1);
+    RemoveLastByteAndCheckFailureToDeserialize(scene);
+
+    // Zero-copy view.
+    oreo::DeserializationArchive view_da(sa.buffer_);
+    SceneView view;
+    assert(view_da.Process(view));
+    assert(view.points_.size_ == 2);
+    assert(reinterpret_cast<const uint8_t*>(view.points_.data_) ==
+           sa.buffer_.data() + 20);
+    assert(view.points_.data_[1] == scene.points_[1]);
+    // A view is serialized like a Raw vector.
+    oreo::SerializationArchive view_sa;
+    view_sa.Process(view);
+    assert(std::equal(view_sa.buffer_.begin(), view_sa.buffer_.end(),
+                      sa.buffer_.begin()));
+    // Views on misaligned data are rejected.
+    std::vector<uint8_t> misaligned = {0};
+    misaligned.insert(misaligned.end(), sa.buffer_.begin(), sa.buffer_.end());
+    oreo::DeserializationArchive misaligned_da(misaligned.data() + 1,
+                                               misaligned.data() +
+                                                   misaligned.size());
+    assert(misaligned_da.Process(view) == false);
+
+    // Diff and patch.
+    Scene scene3;
+    scene3.name_ = scene.name_;
+    scene3.origin_ = scene.origin_;
+    scene3.points_ = scene.points_;
+    scene3.particles_ = scene.particles_;
+    scene3.particles_[1].id_ = 10;
+    oreo::DiffArchive diff;
+    assert(diff.Diff(scene, scene3));
+    std::vector<uint8_t> expected_patch = {4, 3, 1, 0};
+    assert(std::equal(expected_patch.begin(), expected_patch.end(),
+                      diff.buffer_.begin()));
+    oreo::PatchArchive pa(diff.buffer_);
+    assert(pa.Apply(scene2));
+    assert(scene2.particles_[1].id_ == 10);
+    scene3.particles_[1].id_ = 8;
+    assert(diff.Diff(scene, scene3) == false);
+  }
+
   printf("tests successfully passed\n");
   return EXIT_SUCCESS;
 }
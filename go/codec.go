@@ -0,0 +1,366 @@
+package oreo
+
+import (
+	"fmt"
+	"reflect"
+	"sync"
+)
+
+// An encoder appends the encoding of the value held by `v` to `dst`.
+type encoderFunc func(dst []byte, v reflect.Value) []byte
+
+// A decoder populates `v`, which must be settable, by reading data from `d`.
+type decoderFunc func(d *Decoder, v reflect.Value) error
+
+// Maximum number of elements of a deserialized slice.
+const maxArrayLength = 10000
+
+// Encoders and decoders are built once per type, then reused.
+var encoderCache sync.Map // map[reflect.Type]encoderFunc
+var decoderCache sync.Map // map[reflect.Type]decoderFunc
+
+// Returns the cached encoder of `t`, building it if needed.
+func encoderFor(t reflect.Type) encoderFunc {
+	if f, ok := encoderCache.Load(t); ok {
+		return f.(encoderFunc)
+	}
+	// Recursive types (e.g. a struct with a pointer to itself) need the encoder
+	// while it is being built: store a placeholder that waits for it.
+	var wg sync.WaitGroup
+	var f encoderFunc
+	wg.Add(1)
+	placeholder, loaded := encoderCache.LoadOrStore(t, encoderFunc(func(dst []byte, v reflect.Value) []byte {
+		wg.Wait()
+		return f(dst, v)
+	}))
+	if loaded {
+		return placeholder.(encoderFunc)
+	}
+	f = newEncoder(t)
+	wg.Done()
+	encoderCache.Store(t, f)
+	return f
+}
+
+// Returns the cached decoder of `t`, building it if needed.
+func decoderFor(t reflect.Type) decoderFunc {
+	if f, ok := decoderCache.Load(t); ok {
+		return f.(decoderFunc)
+	}
+	var wg sync.WaitGroup
+	var f decoderFunc
+	wg.Add(1)
+	placeholder, loaded := decoderCache.LoadOrStore(t, decoderFunc(func(d *Decoder, v reflect.Value) error {
+		wg.Wait()
+		return f(d, v)
+	}))
+	if loaded {
+		return placeholder.(decoderFunc)
+	}
+	f = newDecoder(t)
+	wg.Done()
+	decoderCache.Store(t, f)
+	return f
+}
+
+func newEncoder(t reflect.Type) encoderFunc {
+	switch t.Kind() {
+	case reflect.Bool:
+		return func(dst []byte, v reflect.Value) []byte {
+			return AppendBool(dst, v.Bool())
+		}
+	case reflect.Int8:
+		return func(dst []byte, v reflect.Value) []byte {
+			return AppendInt8(dst, int8(v.Int()))
+		}
+	case reflect.Uint8:
+		return func(dst []byte, v reflect.Value) []byte {
+			return append(dst, byte(v.Uint()))
+		}
+	case reflect.Uint, reflect.Uint16, reflect.Uint32, reflect.Uint64:
+		return func(dst []byte, v reflect.Value) []byte {
+			return AppendVariableLengthInt(dst, v.Uint())
+		}
+	case reflect.Int, reflect.Int16, reflect.Int32, reflect.Int64:
+		return func(dst []byte, v reflect.Value) []byte {
+			return AppendVariableLengthInt(dst, uint64(v.Int()))
+		}
+	case reflect.String:
+		return func(dst []byte, v reflect.Value) []byte {
+			return AppendString(dst, v.String())
+		}
+	case reflect.Array, reflect.Slice:
+		return newArrayEncoder(t)
+	case reflect.Pointer:
+		return newPointerEncoder(t)
+	case reflect.Interface:
+		// The dynamic type is only known at runtime.
+		return func(dst []byte, v reflect.Value) []byte {
+			if v.IsNil() {
+				return AppendBool(dst, false)
+			}
+			return encoderFor(v.Elem().Type())(dst, v.Elem())
+		}
+	case reflect.Struct:
+		return newStructEncoder(t)
+	default:
+		// Other kinds are not serialized.
+		return func(dst []byte, v reflect.Value) []byte {
+			return dst
+		}
+	}
+}
+
+// Slices are encoded with their length. Arrays are not, like std::array in
+// the C++ implementation.
+func newArrayEncoder(t reflect.Type) encoderFunc {
+	elemEncoder := encoderFor(t.Elem())
+	isSlice := t.Kind() == reflect.Slice
+	isBytes := t.Elem().Kind() == reflect.Uint8
+	return func(dst []byte, v reflect.Value) []byte {
+		length := v.Len()
+		if isSlice {
+			dst = AppendVariableLengthInt(dst, uint64(length))
+		}
+		// Speed optimisation for slices and arrays of bytes.
+		if isBytes {
+			if isSlice || v.CanAddr() {
+				return append(dst, v.Bytes()...)
+			}
+			// Arrays that are not addressable (e.g. struct fields of a value
+			// passed to Append) cannot be viewed as a slice, but can be copied.
+			n := len(dst)
+			dst = append(dst, make([]byte, length)...)
+			reflect.Copy(reflect.ValueOf(dst[n:]), v)
+			return dst
+		}
+		for j := 0; j < length; j++ {
+			dst = elemEncoder(dst, v.Index(j))
+		}
+		return dst
+	}
+}
+
+func newPointerEncoder(t reflect.Type) encoderFunc {
+	elemEncoder := encoderFor(t.Elem())
+	return func(dst []byte, v reflect.Value) []byte {
+		if v.IsNil() {
+			return AppendBool(dst, false)
+		}
+		return elemEncoder(AppendBool(dst, true), v.Elem())
+	}
+}
+
+type fieldEncoder struct {
+	index   int
+	encoder encoderFunc
+}
+
+// Unexported fields are skipped.
+func newStructEncoder(t reflect.Type) encoderFunc {
+	var fields []fieldEncoder
+	for i := 0; i < t.NumField(); i++ {
+		field := t.Field(i)
+		if !field.IsExported() {
+			continue
+		}
+		fields = append(fields, fieldEncoder{index: i, encoder: encoderFor(field.Type)})
+	}
+	return func(dst []byte, v reflect.Value) []byte {
+		for _, field := range fields {
+			dst = field.encoder(dst, v.Field(field.index))
+		}
+		return dst
+	}
+}
+
+func newDecoder(t reflect.Type) decoderFunc {
+	kind := t.Kind()
+	var decoder decoderFunc
+	switch kind {
+	case reflect.Struct:
+		// Struct decoders report the failing field themselves.
+		return newStructDecoder(t)
+	case reflect.Bool:
+		decoder = func(d *Decoder, v reflect.Value) error {
+			b, err := d.ReadBool()
+			if err != nil {
+				return err
+			}
+			v.SetBool(b)
+			return nil
+		}
+	case reflect.String:
+		decoder = func(d *Decoder, v reflect.Value) error {
+			s, err := d.ReadString()
+			if err != nil {
+				return err
+			}
+			v.SetString(s)
+			return nil
+		}
+	case reflect.Int8:
+		decoder = func(d *Decoder, v reflect.Value) error {
+			b, err := d.ReadByte()
+			if err != nil {
+				return err
+			}
+			v.SetInt(int64(int8(b)))
+			return nil
+		}
+	case reflect.Uint8:
+		decoder = func(d *Decoder, v reflect.Value) error {
+			b, err := d.ReadByte()
+			if err != nil {
+				return err
+			}
+			v.SetUint(uint64(b))
+			return nil
+		}
+	case reflect.Int, reflect.Int16, reflect.Int32, reflect.Int64:
+		decoder = func(d *Decoder, v reflect.Value) error {
+			u, err := d.ReadVariableLengthInteger()
+			if err != nil {
+				return err
+			}
+			v.SetInt(int64(u))
+			return nil
+		}
+	case reflect.Uint, reflect.Uint16, reflect.Uint32, reflect.Uint64:
+		decoder = func(d *Decoder, v reflect.Value) error {
+			u, err := d.ReadVariableLengthInteger()
+			if err != nil {
+				return err
+			}
+			v.SetUint(u)
+			return nil
+		}
+	case reflect.Slice:
+		decoder = newSliceDecoder(t)
+	case reflect.Array:
+		decoder = newArrayDecoder(t)
+	case reflect.Pointer:
+		decoder = newPointerDecoder(t)
+	default:
+		return func(d *Decoder, v reflect.Value) error {
+			return fmt.Errorf("error deserializing %s: %w", kind,
+				fmt.Errorf("unsupported type for direct deserialization: %s", kind))
+		}
+	}
+	return func(d *Decoder, v reflect.Value) error {
+		err := decoder(d, v)
+		if err != nil {
+			return fmt.Errorf("error deserializing %s: %w", kind, err)
+		}
+		return nil
+	}
+}
+
+func newSliceDecoder(t reflect.Type) decoderFunc {
+	isByteSlice := t.Elem().Kind() == reflect.Uint8
+	elemDecoder := decoderFor(t.Elem())
+	return func(d *Decoder, v reflect.Value) error {
+		length, err := d.ReadVariableLengthInteger()
+		if err != nil {
+			return fmt.Errorf("ReadArray: failed to read array length: %w", err)
+		}
+		// Check for potential overflow that would cause memory issues.
+		if length > maxArrayLength {
+			return fmt.Errorf("ReadArray: array length %d exceeds maximum allowed %d", length, maxArrayLength)
+		}
+		intLen := int(length)
+		newSlice := reflect.MakeSlice(t, intLen, intLen)
+		if isByteSlice {
+			// Speed optimisation for slices of bytes: a single copy.
+			b, err := d.next(length)
+			if err != nil {
+				return fmt.Errorf("ReadArray: failed to read array elements: %w", err)
+			}
+			copy(newSlice.Bytes(), b)
+		} else {
+			for j := 0; j < intLen; j++ {
+				err := elemDecoder(d, newSlice.Index(j))
+				if err != nil {
+					return fmt.Errorf("ReadArray: failed to deserialize element %d (0-based): %w", j, err)
+				}
+			}
+		}
+		v.Set(newSlice)
+		return nil
+	}
+}
+
+// Arrays are encoded without their length.
+func newArrayDecoder(t reflect.Type) decoderFunc {
+	isByteArray := t.Elem().Kind() == reflect.Uint8
+	elemDecoder := decoderFor(t.Elem())
+	return func(d *Decoder, v reflect.Value) error {
+		if isByteArray {
+			// Speed optimisation for arrays of bytes: a single copy.
+			b, err := d.next(uint64(t.Len()))
+			if err != nil {
+				return fmt.Errorf("ReadArray: failed to read array elements: %w", err)
+			}
+			copy(v.Bytes(), b)
+			return nil
+		}
+		for j := 0; j < t.Len(); j++ {
+			err := elemDecoder(d, v.Index(j))
+			if err != nil {
+				return fmt.Errorf("ReadArray: failed to deserialize element %d (0-based): %w", j, err)
+			}
+		}
+		return nil
+	}
+}
+
+func newPointerDecoder(t reflect.Type) decoderFunc {
+	elemDecoder := decoderFor(t.Elem())
+	return func(d *Decoder, v reflect.Value) error {
+		isValid, err := d.ReadBool()
+		if err != nil {
+			return fmt.Errorf("ReadPointer: failed to read validity flag: %w", err)
+		}
+		if !isValid {
+			v.Set(reflect.Zero(t))
+			return nil
+		}
+		newValue := reflect.New(t.Elem())
+		v.Set(newValue)
+		return elemDecoder(d, newValue.Elem())
+	}
+}
+
+type fieldDecoder struct {
+	index   int
+	name    string
+	kind    reflect.Kind
+	decoder decoderFunc
+}
+
+// Unexported fields are skipped.
+func newStructDecoder(t reflect.Type) decoderFunc {
+	var fields []fieldDecoder
+	for i := 0; i < t.NumField(); i++ {
+		field := t.Field(i)
+		if !field.IsExported() {
+			continue
+		}
+		fields = append(fields, fieldDecoder{
+			index:   i,
+			name:    field.Name,
+			kind:    field.Type.Kind(),
+			decoder: decoderFor(field.Type),
+		})
+	}
+	return func(d *Decoder, v reflect.Value) error {
+		for _, field := range fields {
+			err := field.decoder(d, v.Field(field.index))
+			if err != nil {
+				return fmt.Errorf("error deserializing struct field '%s' (%s): %w",
+					field.name, field.kind, err)
+			}
+		}
+		return nil
+	}
+}
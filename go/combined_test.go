@@ -19,6 +19,11 @@ func CheckSerialization(t *testing.T, i interface{}, expected []byte) {
 
 	assert.Equal(t, len(expected), buf.Len(), "Buffer length should match expected length")
 	assert.Equal(t, expected, buf.Bytes(), "Serialized value should match expected value")
+
+	// Append reuses the caller's buffer.
+	prefix := []byte{0xaa}
+	appended := Append(prefix, i)
+	assert.Equal(t, expected, appended[1:], "Appended value should match expected value")
 }
 
 func CheckDeserialization(t *testing.T, buffer []byte, expected interface{}) {
@@ -54,6 +59,24 @@ func CheckDeserialization(t *testing.T, buffer []byte, expected interface{}) {
 			actualValue, actualValue,
 			initialLen, buffer)
 	}
+
+	// Decoding from the byte slice, with and without string views.
+	for _, stringViews := range []bool{false, true} {
+		d := NewDecoder(buffer)
+		d.StringViews = stringViews
+		targetPtrVal := reflect.New(expectedType)
+		err := d.Decode(targetPtrVal.Interface())
+		if err != nil {
+			t.Fatalf("Decode failed unexpectedly:\n Error: %v\n Buffer: %x", err, buffer)
+		}
+		if d.Len() > 0 {
+			t.Fatalf("Buffer not fully consumed after Decode:\n Bytes remaining: %d", d.Len())
+		}
+		if !reflect.DeepEqual(targetPtrVal.Elem().Interface(), expected) {
+			t.Fatalf("Decoded value mismatch:\n Expected: %#v\n Actual:   %#v",
+				expected, targetPtrVal.Elem().Interface())
+		}
+	}
 }
 
 func Check(t *testing.T, i interface{}, expected []byte) {
@@ -206,3 +229,231 @@ func TestPointers(t *testing.T) {
 		Check(t, testStruct, expected)
 	}
 }
+
+func TestNamedTypes(t *testing.T) {
+	type Enum int8
+	type Id uint32
+	type Named struct {
+		A Enum
+		B Id
+		C []Enum
+		D []byte
+	}
+	Check(t, Named{A: 1, B: 300, C: []Enum{2, 3}, D: []byte{4, 5}}, []byte{
+		1,      // A
+		172, 2, // B
+		2, 2, 3, // C
+		2, 4, 5, // D
+	})
+}
+
+func TestUnexportedFields(t *testing.T) {
+	type TestStruct struct {
+		A int8
+		b string
+		C int8
+	}
+	CheckSerialization(t, TestStruct{A: 1, b: "ignored", C: 2}, []byte{1, 2})
+	CheckDeserialization(t, []byte{1, 2}, TestStruct{A: 1, C: 2})
+}
+
+type ListNode struct {
+	Value int32
+	Next  *ListNode
+}
+
+func TestRecursiveType(t *testing.T) {
+	list := ListNode{Value: 1, Next: &ListNode{Value: 2, Next: &ListNode{Value: 300}}}
+	Check(t, list, []byte{
+		1, 1, // First node, Next is set
+		2, 1, // Second node, Next is set
+		172, 2, 0, // Third node, Next is nil
+	})
+}
+
+func TestFixedSizeArray(t *testing.T) {
+	// Like std::array in the C++ implementation, arrays have no length prefix.
+	Check(t, [3]byte{1, 2, 3}, []byte{1, 2, 3})
+	Check(t, [2]int32{1, 300}, []byte{1, 172, 2})
+	type TestStruct struct {
+		A [4]byte
+		B [2]string
+	}
+	// A is not addressable: it is copied with reflect.Copy.
+	Check(t, TestStruct{A: [4]byte{9, 8, 7, 6}, B: [2]string{"a", "b"}}, []byte{
+		9, 8, 7, 6, // A
+		1, 'a', 1, 'b', // B
+	})
+	// Elements of slices and pointed-to arrays are addressable, and are viewed
+	// as a slice.
+	assert.Equal(t, true, reflect.ValueOf([][4]byte{{}}).Index(0).CanAddr())
+	Check(t, [][4]byte{{1, 2, 3, 4}, {5, 6, 7, 8}}, []byte{
+		2,          // length
+		1, 2, 3, 4, // [0]
+		5, 6, 7, 8, // [1]
+	})
+	Check(t, &[4]byte{1, 2, 3, 4}, []byte{1, 1, 2, 3, 4})
+
+	var truncated [4]byte
+	err := NewDecoder([]byte{1, 2, 3}).Decode(&truncated)
+	if err == nil {
+		t.Fatal("Decode should fail when the array is truncated")
+	}
+}
+
+func TestBytes(t *testing.T) {
+	data := AppendBytes(nil, []byte{1, 2, 3})
+	assert.Equal(t, []byte{3, 1, 2, 3}, data)
+	b, err := NewDecoder(data).ReadBytes()
+	if err != nil {
+		t.Fatal(err)
+	}
+	assert.Equal(t, []byte{1, 2, 3}, b)
+	// The result does not alias the decoded data.
+	data[1] = 42
+	assert.Equal(t, []byte{1, 2, 3}, b)
+
+	// The same limit as for other slices applies.
+	_, err = NewDecoder(AppendBytes(nil, make([]byte, maxArrayLength+1))).ReadBytes()
+	if err == nil {
+		t.Fatal("ReadBytes should fail when the length exceeds maxArrayLength")
+	}
+}
+
+func TestStringViews(t *testing.T) {
+	data := AppendString(nil, "hello")
+	d := NewDecoder(data)
+	d.StringViews = true
+	s, err := d.ReadString()
+	if err != nil {
+		t.Fatal(err)
+	}
+	assert.Equal(t, "hello", s)
+	data[1] = 'j'
+	assert.Equal(t, "jello", s)
+}
+
+func TestDecoderErrors(t *testing.T) {
+	var s string
+	var i int64
+	var b []byte
+	for _, data := range [][]byte{
+		{},
+		{0x80},
+		{5, 'a', 'b'},
+	} {
+		if NewDecoder(data).Decode(&s) == nil {
+			t.Fatalf("Decoding a string from %x should fail", data)
+		}
+		if NewDecoder(data).Decode(&b) == nil {
+			t.Fatalf("Decoding bytes from %x should fail", data)
+		}
+	}
+	tooLong := []byte{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 1}
+	if NewDecoder(tooLong).Decode(&i) == nil {
+		t.Fatal("Decoding an integer longer than 10 bytes should fail")
+	}
+}
+
+type benchmarkInner struct {
+	X int8
+	Y string
+}
+
+type benchmarkStruct struct {
+	A int8
+	B string
+	C []int32
+	D benchmarkInner
+	E []benchmarkInner
+	F *benchmarkInner
+	G []byte
+}
+
+func newBenchmarkStruct() benchmarkStruct {
+	s := benchmarkStruct{
+		A: 1,
+		B: "hello",
+		D: benchmarkInner{X: 2, Y: "world"},
+		F: &benchmarkInner{X: 3, Y: "foo"},
+		G: make([]byte, 256),
+	}
+	for i := 0; i < 100; i++ {
+		s.C = append(s.C, int32(i*1000))
+		s.E = append(s.E, benchmarkInner{X: int8(i), Y: "bar"})
+	}
+	return s
+}
+
+func BenchmarkSerialize(b *testing.B) {
+	s := newBenchmarkStruct()
+	buf := new(bytes.Buffer)
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		buf.Reset()
+		if err := Serialize(s, buf); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkDeserialize(b *testing.B) {
+	buf := new(bytes.Buffer)
+	if err := Serialize(newBenchmarkStruct(), buf); err != nil {
+		b.Fatal(err)
+	}
+	data := buf.Bytes()
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		var s benchmarkStruct
+		if err := Deserialize(bytes.NewBuffer(data), &s); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkAppend(b *testing.B) {
+	s := newBenchmarkStruct()
+	var dst []byte
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		dst = Append(dst[:0], s)
+	}
+}
+
+func BenchmarkDecode(b *testing.B) {
+	data := Append(nil, newBenchmarkStruct())
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		var s benchmarkStruct
+		if err := NewDecoder(data).Decode(&s); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkDecodeStringViews(b *testing.B) {
+	data := Append(nil, newBenchmarkStruct())
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		var s benchmarkStruct
+		d := NewDecoder(data)
+		d.StringViews = true
+		if err := d.Decode(&s); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkAppendByteArray(b *testing.B) {
+	type byteArrayStruct struct {
+		A int8
+		B [4096]byte
+	}
+	s := byteArrayStruct{A: 1}
+	var dst []byte
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		dst = Append(dst[:0], s)
+	}
+}
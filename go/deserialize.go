@@ -4,9 +4,142 @@ import (
 	"bytes"
 	"errors"
 	"fmt"
+	"io"
 	"reflect"
+	"unsafe"
 )
 
+var errVariableLengthIntegerOverflow = errors.New("variable length integer overflows 64 bits")
+
+// Decoder reads values from a byte slice, without copying it.
+type Decoder struct {
+	data []byte
+	pos  int
+
+	// When set, decoded strings share memory with the data passed to
+	// NewDecoder instead of being copied. The data must then not be modified
+	// while the strings are in use.
+	StringViews bool
+}
+
+func NewDecoder(data []byte) *Decoder {
+	return &Decoder{data: data}
+}
+
+// Number of bytes that have not been read yet.
+func (d *Decoder) Len() int {
+	return len(d.data) - d.pos
+}
+
+func (d *Decoder) ReadByte() (byte, error) {
+	if d.pos >= len(d.data) {
+		return 0, io.EOF
+	}
+	b := d.data[d.pos]
+	d.pos++
+	return b, nil
+}
+
+func (d *Decoder) ReadBool() (bool, error) {
+	b, err := d.ReadByte()
+	return b != 0, err
+}
+
+func (d *Decoder) ReadVariableLengthInteger() (uint64, error) {
+	// Fast path for values that fit in one byte.
+	if d.pos < len(d.data) && d.data[d.pos] < 0b10000000 {
+		v := uint64(d.data[d.pos])
+		d.pos++
+		return v, nil
+	}
+	if d.pos >= len(d.data) {
+		return 0, io.EOF
+	}
+	var v uint64
+	shift := 0
+	for i := d.pos; i < len(d.data); i++ {
+		// Check for corrupted stream: read a max of 10 bytes.
+		if shift > 63 {
+			return 0, errVariableLengthIntegerOverflow
+		}
+		b := d.data[i]
+		v |= uint64(b&0x7F) << shift
+		if b&0x80 == 0 {
+			d.pos = i + 1
+			return v, nil
+		}
+		shift += 7
+	}
+	return 0, io.ErrUnexpectedEOF
+}
+
+// Returns the next `n` bytes without copying them.
+func (d *Decoder) next(n uint64) ([]byte, error) {
+	if n > uint64(d.Len()) {
+		return nil, io.ErrUnexpectedEOF
+	}
+	b := d.data[d.pos : d.pos+int(n)]
+	d.pos += int(n)
+	return b, nil
+}
+
+func (d *Decoder) ReadString() (string, error) {
+	length, err := d.ReadVariableLengthInteger()
+	if err != nil {
+		return "", err
+	}
+	b, err := d.next(length)
+	if err != nil {
+		return "", err
+	}
+	if d.StringViews {
+		return unsafe.String(unsafe.SliceData(b), len(b)), nil
+	}
+	return string(b), nil
+}
+
+// Reads a slice of bytes written by AppendBytes. The bytes are copied once.
+// Like for other slices, at most `maxArrayLength` bytes are accepted.
+func (d *Decoder) ReadBytes() ([]byte, error) {
+	length, err := d.ReadVariableLengthInteger()
+	if err != nil {
+		return nil, err
+	}
+	if length > maxArrayLength {
+		return nil, fmt.Errorf("ReadBytes: length %d exceeds maximum allowed %d", length, maxArrayLength)
+	}
+	b, err := d.next(length)
+	if err != nil {
+		return nil, err
+	}
+	return append([]byte(nil), b...), nil
+}
+
+// Populates the variable pointed to by `v` by reading data from `d`.
+// If `v` points to a struct, it deserializes field by field based on struct order.
+// If `v` points to a basic type (bool, int, string...), it deserializes directly into it.
+// The decoder of each type is built on first use and cached.
+func (d *Decoder) Decode(v interface{}) error {
+	ptrVal := reflect.ValueOf(v)
+
+	// We need a pointer to modify the original variable.
+	if ptrVal.Kind() != reflect.Ptr {
+		return fmt.Errorf("Deserialize: expected a pointer, got %T", v)
+	}
+	if ptrVal.IsNil() {
+		return fmt.Errorf("Deserialize: expected a non-nil pointer, got nil %T", v)
+	}
+
+	targetVal := ptrVal.Elem()
+
+	// Check if the pointed-to element is settable.
+	if !targetVal.CanSet() {
+		return fmt.Errorf("Deserialize: cannot set value of type %s (is it addressable/exported?)", targetVal.Type())
+	}
+
+	return decoderFor(targetVal.Type())(d, targetVal)
+}
+
 func ReadBool(buf *bytes.Buffer, i *bool) error {
 	b, err := buf.ReadByte()
 	if err != nil {
@@ -17,18 +150,13 @@ func ReadBool(buf *bytes.Buffer, i *bool) error {
 }
 
 func ReadVariableLengthInteger(buf *bytes.Buffer, i *uint64) error {
-	shift := int(0)
-	for {
-		b, err := buf.ReadByte()
-		if err != nil {
-			return err
-		}
-		*i |= uint64(b&0x7F) << shift
-		if b&0x80 == 0 {
-			break
-		}
-		shift += 7
+	d := Decoder{data: buf.Bytes()}
+	u, err := d.ReadVariableLengthInteger()
+	buf.Next(d.pos)
+	if err != nil {
+		return err
 	}
+	*i |= u
 	return nil
 }
 
@@ -125,22 +253,18 @@ func ReadUint64(buf *bytes.Buffer, i *uint64) error {
 }
 
 func ReadString(buf *bytes.Buffer, i *string) error {
-	var length uint64
-	err := ReadVariableLengthInteger(buf, &length)
+	d := Decoder{data: buf.Bytes()}
+	str, err := d.ReadString()
+	buf.Next(d.pos)
 	if err != nil {
 		return err
 	}
-	strBytes := make([]byte, length)
-	_, err = buf.Read(strBytes)
-	if err != nil {
-		return err
-	}
-	*i = string(strBytes)
+	*i = str
 	return nil
 }
 
 func ReadArray(buf *bytes.Buffer, i interface{}) error {
-	// 1. Validate input 'i' is a pointer to a slice
+	// Validate input 'i' is a pointer to a slice
 	ptrVal := reflect.ValueOf(i)
 	if ptrVal.Kind() != reflect.Ptr {
 		return errors.New("ReadArray: input is not a pointer")
@@ -151,37 +275,10 @@ func ReadArray(buf *bytes.Buffer, i interface{}) error {
 		return errors.New("ReadArray: input is not a pointer to a slice")
 	}
 
-	// 2. Read the length of the array
-	var length uint64
-	err := ReadVariableLengthInteger(buf, &length)
-	if err != nil {
-		return fmt.Errorf("ReadArray: failed to read array length: %w", err)
-	}
-
-	// Check for potential overflow that would cause memory issues.
-	const maxLen = 10000
-	if length > maxLen {
-		return fmt.Errorf("ReadArray: array length %d exceeds maximum allowed %d", length, maxLen)
-	}
-	intLen := int(length)
-
-	// 3. Create a new slice of the correct type and length
-	sliceType := sliceVal.Type()                             // Type of the slice (e.g., []int32)
-	newSlice := reflect.MakeSlice(sliceType, intLen, intLen) // Create new slice
-
-	// 4. Deserialize each element into the new slice
-	for j := 0; j < intLen; j++ {
-		// Get a pointer to the j-th element in the new slice
-		elemPtr := newSlice.Index(j).Addr().Interface()
-		// Deserialize into the element pointer
-		err := Deserialize(buf, elemPtr)
-		if err != nil {
-			return fmt.Errorf("ReadArray: failed to deserialize element %d (0-based): %w", j, err)
-		}
-	}
-
-	sliceVal.Set(newSlice)
-	return nil
+	d := Decoder{data: buf.Bytes()}
+	err := newSliceDecoder(sliceVal.Type())(&d, sliceVal)
+	buf.Next(d.pos)
+	return err
 }
 
 // ReadPointer deserializes a pointer from the buffer.
@@ -204,113 +301,17 @@ func ReadPointer(buf *bytes.Buffer, i interface{}) error {
 		return errors.New("ReadPointer: inner pointer is not settable")
 	}
 
-	// 2. Read the validity flag (boolean indicating if the pointer is non-nil)
-	var isValid bool
-	err := ReadBool(buf, &isValid)
-	if err != nil {
-		return fmt.Errorf("ReadPointer: failed to read validity flag: %w", err)
-	}
-
-	// 3. Handle based on the validity flag
-	if !isValid {
-		// Pointer is nil, set the target pointer to its zero value (nil)
-		innerPtrVal.Set(reflect.Zero(innerPtrVal.Type())) // Set the *int (or *MyStruct etc.) to nil
-		return nil
-	} else {
-		// Pointer is valid, need to allocate and deserialize the underlying value
-
-		// Get the type of the element the pointer should point to (e.g., int from *int)
-		elemType := innerPtrVal.Type().Elem()
-
-		// Create a new value of the element type (allocates memory)
-		// reflect.New returns a Value representing a pointer to a new zero value for 'elemType'.
-		// So, if elemType is int, newValue is a Value representing *int.
-		newValue := reflect.New(elemType)
-
-		// Set the inner pointer (e.g., the *int) to point to this newly allocated memory.
-		innerPtrVal.Set(newValue)
-
-		// Now, deserialize the data *into* the newly allocated memory.
-		// We pass the interface{} representation of the pointer to the new memory.
-		return Deserialize(buf, newValue.Interface())
-	}
+	d := Decoder{data: buf.Bytes()}
+	err := newPointerDecoder(innerPtrVal.Type())(&d, innerPtrVal)
+	buf.Next(d.pos)
+	return err
 }
 
 // Populates the variable pointed to by `v` by reading data from `buf“.
-// If `v` points to a struct, it deserializes field by field based on struct order.
-// If `v` points to a basic type (bool, int, string...), it deserializes directly into it.
+// See Decoder.Decode.
 func Deserialize(buf *bytes.Buffer, v interface{}) error {
-	ptrVal := reflect.ValueOf(v)
-
-	// We need a pointer to modify the original variable.
-	if ptrVal.Kind() != reflect.Ptr {
-		return fmt.Errorf("Deserialize: expected a pointer, got %T", v)
-	}
-	if ptrVal.IsNil() {
-		return fmt.Errorf("Deserialize: expected a non-nil pointer, got nil %T", v)
-	}
-
-	targetVal := ptrVal.Elem()
-
-	// Check if the pointed-to element is settable.
-	if !targetVal.CanSet() {
-		return fmt.Errorf("Deserialize: cannot set value of type %s (is it addressable/exported?)", targetVal.Type())
-	}
-
-	if targetVal.Kind() == reflect.Struct {
-		structType := targetVal.Type()
-		for i := 0; i < targetVal.NumField(); i++ {
-			fieldVal := targetVal.Field(i)
-			if !fieldVal.CanSet() { // Skip unexported/unsettable fields
-				continue
-			}
-			fieldPtrVal := fieldVal.Addr()
-			fieldPtrInterface := fieldPtrVal.Interface()
-			err := Deserialize(buf, fieldPtrInterface)
-			if err != nil {
-				fieldType := structType.Field(i) // Field metadata
-				return fmt.Errorf("error deserializing struct field '%s' (%s): %w",
-					fieldType.Name, fieldVal.Kind(), err)
-			}
-		}
-		return nil
-	} else {
-		var err error
-		switch targetVal.Kind() {
-		case reflect.Bool:
-			err = ReadBool(buf, v.(*bool))
-		case reflect.String:
-			err = ReadString(buf, v.(*string))
-		case reflect.Uint:
-			err = ReadUint(buf, v.(*uint))
-		case reflect.Uint8:
-			err = ReadUint8(buf, v.(*uint8))
-		case reflect.Uint16:
-			err = ReadUint16(buf, v.(*uint16))
-		case reflect.Uint32:
-			err = ReadUint32(buf, v.(*uint32))
-		case reflect.Uint64:
-			err = ReadUint64(buf, v.(*uint64))
-		case reflect.Int:
-			err = ReadInt(buf, v.(*int))
-		case reflect.Int8:
-			err = ReadInt8(buf, v.(*int8))
-		case reflect.Int16:
-			err = ReadInt16(buf, v.(*int16))
-		case reflect.Int32:
-			err = ReadInt32(buf, v.(*int32))
-		case reflect.Int64:
-			err = ReadInt64(buf, v.(*int64))
-		case reflect.Slice:
-			err = ReadArray(buf, v)
-		case reflect.Pointer:
-			err = ReadPointer(buf, v)
-		default:
-			err = fmt.Errorf("unsupported type for direct deserialization: %s", targetVal.Kind())
-		}
-		if err != nil {
-			return fmt.Errorf("error deserializing %s: %w", targetVal.Kind(), err)
-		}
-		return nil
-	}
+	d := Decoder{data: buf.Bytes()}
+	err := d.Decode(v)
+	buf.Next(d.pos)
+	return err
 }
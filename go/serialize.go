@@ -5,108 +5,80 @@ import (
 	"reflect"
 )
 
-func WriteBool(v bool, buf *bytes.Buffer) error {
-	b := func() int8 {
-		if v {
-			return int8(1)
-		}
-		return int8(0)
-	}()
-	return buf.WriteByte(byte(b))
+// The AppendXxx functions append the encoding of a value to `dst` and return
+// the extended slice, so that callers can reuse their buffers.
+
+func AppendBool(dst []byte, v bool) []byte {
+	if v {
+		return append(dst, 1)
+	}
+	return append(dst, 0)
 }
 
-func WriteInt8(v int8, buf *bytes.Buffer) error {
-	return buf.WriteByte(byte(v))
+func AppendInt8(dst []byte, v int8) []byte {
+	return append(dst, byte(v))
 }
 
-func WriteVariableLengthInt(v uint64, buf *bytes.Buffer) error {
+func AppendVariableLengthInt(dst []byte, v uint64) []byte {
 	for v >= 0b10000000 {
-		err := buf.WriteByte(byte(v | 0b10000000))
-		if err != nil {
-			return err
-		}
+		dst = append(dst, byte(v|0b10000000))
 		v >>= 7
 	}
+	return append(dst, byte(v))
+}
+
+func AppendString(dst []byte, s string) []byte {
+	dst = AppendVariableLengthInt(dst, uint64(len(s)))
+	return append(dst, s...)
+}
+
+// Appends a slice of bytes: its length, then its content.
+func AppendBytes(dst []byte, b []byte) []byte {
+	dst = AppendVariableLengthInt(dst, uint64(len(b)))
+	return append(dst, b...)
+}
+
+// Appends the encoding of `i` to `dst`. The encoder of each type is built on
+// first use and cached, so values are encoded without boxing or per-value type
+// switches. Unexported struct fields are skipped.
+func Append(dst []byte, i interface{}) []byte {
+	if i == nil {
+		return AppendBool(dst, false)
+	}
+	return encoderFor(reflect.TypeOf(i))(dst, reflect.ValueOf(i))
+}
+
+func WriteBool(v bool, buf *bytes.Buffer) error {
+	if v {
+		return buf.WriteByte(1)
+	}
+	return buf.WriteByte(0)
+}
+
+func WriteInt8(v int8, buf *bytes.Buffer) error {
 	return buf.WriteByte(byte(v))
 }
 
+func WriteVariableLengthInt(v uint64, buf *bytes.Buffer) error {
+	_, err := buf.Write(AppendVariableLengthInt(buf.AvailableBuffer(), v))
+	return err
+}
+
 func WriteString(s string, buf *bytes.Buffer) error {
-	// Write the length of the string
-	err := WriteVariableLengthInt(uint64(len(s)), buf)
-	if err != nil {
-		return err
-	}
-	// Write the string itself
-	_, err = buf.WriteString(s)
+	_, err := buf.Write(AppendString(buf.AvailableBuffer(), s))
 	return err
 }
 
 func WriteArray(i interface{}, buf *bytes.Buffer) error {
-	length := reflect.ValueOf(i).Len()
-	err := WriteVariableLengthInt(uint64(length), buf)
-	if err != nil {
-		return err
-	}
-	for j := 0; j < length; j++ {
-		err = Serialize(reflect.ValueOf(i).Index(j).Interface(), buf)
-		if err != nil {
-			return err
-		}
-	}
-	return nil
+	return Serialize(i, buf)
 }
 
 func WritePointer(i interface{}, buf *bytes.Buffer) error {
-	v := reflect.ValueOf(i)
-	if v.IsNil() {
-		return WriteBool(false, buf)
-	}
-	err := WriteBool(true, buf)
-	if err != nil {
-		return err
-	}
-	return Serialize(v.Elem().Interface(), buf)
+	return Serialize(i, buf)
 }
 
+// Writes `i` to `buf`. See Append.
 func Serialize(i interface{}, buf *bytes.Buffer) error {
-	if i == nil {
-		return WriteBool(false, buf)
-	}
-	t := reflect.TypeOf(i)
-	kind := t.Kind()
-
-	if kind == reflect.Ptr {
-		return WritePointer(i, buf)
-	}
-	if kind == reflect.Bool {
-		return WriteBool(i.(bool), buf)
-	}
-	if kind == reflect.Int8 {
-		return WriteInt8(i.(int8), buf)
-	}
-	if kind == reflect.Uint8 {
-		return WriteInt8(int8(i.(uint8)), buf)
-	}
-	if kind == reflect.Uint || kind == reflect.Uint16 || kind == reflect.Uint32 || kind == reflect.Uint64 {
-		return WriteVariableLengthInt(reflect.ValueOf(i).Uint(), buf)
-	}
-	if kind == reflect.Int || kind == reflect.Int16 || kind == reflect.Int32 || kind == reflect.Int64 {
-		return WriteVariableLengthInt(uint64(reflect.ValueOf(i).Int()), buf)
-	}
-	if kind == reflect.String {
-		return WriteString(i.(string), buf)
-	}
-	if kind == reflect.Array || kind == reflect.Slice {
-		return WriteArray(i, buf)
-	}
-
-	if kind == reflect.Struct {
-		for j := 0; j < t.NumField(); j++ {
-			err := Serialize(reflect.ValueOf(i).Field(j).Interface(), buf)
-			if err != nil {
-				return err
-			}
-		}
-	}
-	return nil
+	_, err := buf.Write(Append(buf.AvailableBuffer(), i))
+	return err
 }